@@ -0,0 +1,18 @@
+/* Host stub: heap_caps functions are served by the simulated heap of the benchmark */
+#pragma once
+#include <stddef.h>
+
+#define MALLOC_CAP_8BIT     (1 << 2)
+#define MALLOC_CAP_SPIRAM   (1 << 10)
+#define MALLOC_CAP_INTERNAL (1 << 11)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+void*  heap_caps_malloc(size_t size, unsigned caps);
+void   heap_caps_free(void* ptr);
+size_t heap_caps_get_free_size(unsigned caps);
+size_t heap_caps_get_largest_free_block(unsigned caps);
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,11 @@
+/* Host stub: only the NVS types used by reNvs.h */
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+typedef int esp_err_t;
+typedef uint32_t nvs_handle_t;
+typedef enum { NVS_READONLY, NVS_READWRITE } nvs_open_mode_t;
+
+#define NVS_KEY_NAME_MAX_SIZE 16
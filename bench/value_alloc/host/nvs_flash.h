@@ -0,0 +1,3 @@
+/* Host stub */
+#pragma once
+#include "nvs.h"
@@ -0,0 +1,7 @@
+/* Host stub */
+#pragma once
+
+#define RLOG_LEVEL_NONE 0
+#ifndef CONFIG_RLOG_PROJECT_LEVEL
+#define CONFIG_RLOG_PROJECT_LEVEL RLOG_LEVEL_NONE
+#endif
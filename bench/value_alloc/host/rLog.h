@@ -0,0 +1,5 @@
+/* Host stub: logging is disabled in the benchmark */
+#pragma once
+#include "project_config.h"
+
+#define RE_MEM_CHECK(a, action) if (!(a)) { action; }
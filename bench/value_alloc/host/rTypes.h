@@ -0,0 +1,11 @@
+/* Host stub: only the types used by reNvs.h */
+#pragma once
+#include <stdint.h>
+
+typedef uint32_t timespan_t;
+
+typedef enum {
+  OPT_TYPE_UNKNOWN = 0,
+  OPT_TYPE_I8, OPT_TYPE_U8, OPT_TYPE_I16, OPT_TYPE_U16, OPT_TYPE_I32, OPT_TYPE_U32, OPT_TYPE_I64, OPT_TYPE_U64,
+  OPT_TYPE_FLOAT, OPT_TYPE_DOUBLE, OPT_TYPE_STRING, OPT_TYPE_TIMEVAL, OPT_TYPE_TIMESPAN
+} param_type_t;
@@ -0,0 +1,13 @@
+/* Host stub: esp_malloc() is served by the simulated heap of the benchmark */
+#pragma once
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+void* bench_heap_malloc(size_t size);
+#ifdef __cplusplus
+}
+#endif
+
+#define esp_malloc(size) bench_heap_malloc(size)
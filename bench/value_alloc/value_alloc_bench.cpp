@@ -0,0 +1,340 @@
+/*
+ *  Host benchmark: long-run heap fragmentation with the slab value allocator vs plain malloc/free
+ *  ----------------------------------------------------------------------------------------------------------------------
+ *  Runs the same deterministic workload twice against a simulated first-fit heap (8-byte block headers, coalescing on
+ *  free, roughly what the ESP-IDF TLSF/multi-heap does with small blocks):
+ *    - "malloc": nvsValueSetAllocator() routes parameter values straight to the simulated heap (behaviour before the slab);
+ *    - "slab":   default allocator with CONFIG_NVS_VALUE_SLAB_ENABLE; the simulated heap is reduced by the size of the
+ *                static slab arena so that both runs have the same total amount of RAM.
+ *  The workload mixes parameter updates (allocate new value, free old one) with unrelated "system" allocations of
+ *  various sizes and periodic 16 KB requests, like the TLS buffers needed for an HTTPS or MQTTS connection.
+ *
+ *  Build and run from the repository root:
+ *    g++ -std=gnu++17 -O2 -DCONFIG_NVS_VALUE_SLAB_ENABLE=1 -DCONFIG_NVS_VALUE_SLAB_BLOCKS=32 \
+ *        -Ibench/value_alloc/host -Iinclude src/reNvsAlloc.cpp bench/value_alloc/value_alloc_bench.cpp -o value_alloc_bench
+ *    ./value_alloc_bench
+ *  Add -DBENCH_HEAP_SIZE="(40*1024)" to change the amount of RAM. Compare several CONFIG_NVS_VALUE_SLAB_BLOCKS values:
+ *  the arena is static, so an oversized slab costs more RAM than it saves and the "slab" run gets worse than "malloc".
+ *  ----------------------------------------------------------------------------------------------------------------------
+ *  Тест на хосте: долговременная фрагментация кучи при использовании slab-аллокатора значений и обычного malloc/free
+ *  ----------------------------------------------------------------------------------------------------------------------
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "reNvs.h"
+#include "esp_heap_caps.h"
+
+#if !CONFIG_NVS_VALUE_SLAB_ENABLE
+#error "Build the benchmark with -DCONFIG_NVS_VALUE_SLAB_ENABLE=1"
+#endif // CONFIG_NVS_VALUE_SLAB_ENABLE
+
+#ifndef BENCH_HEAP_SIZE
+#define BENCH_HEAP_SIZE       (48 * 1024)
+#endif // BENCH_HEAP_SIZE
+#define BENCH_SLAB_ARENA_SIZE (((1 << NVS_VALUE_SLAB_CLASSES) - 1) * CONFIG_NVS_VALUE_SLAB_BLOCKS)
+#define BENCH_STEPS           200000
+#define BENCH_CHECKPOINT      25000
+#define BENCH_TLS_PERIOD      500
+#define BENCH_TLS_SIZE        (16 * 1024)
+#define BENCH_PARAMS          160
+#define BENCH_SYSTEM_OBJECTS  48
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------ Simulated heap -------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#define HEAP_HEADER 8
+#define HEAP_ALIGN  8
+#define HEAP_MIN    (HEAP_HEADER + HEAP_ALIGN)
+
+typedef struct {
+  uint32_t size;   // Full block size including header
+  uint32_t used;
+} heap_block_t;
+
+static uint8_t _heap[BENCH_HEAP_SIZE] __attribute__((aligned(8)));
+static size_t _heapSize = 0;
+
+static inline heap_block_t* heapBlock(size_t offset)
+{
+  return (heap_block_t*)(_heap + offset);
+}
+
+static void heapReset(size_t size)
+{
+  _heapSize = size & ~(size_t)(HEAP_ALIGN - 1);
+  heapBlock(0)->size = _heapSize;
+  heapBlock(0)->used = 0;
+}
+
+// Merges a free block with all free blocks that immediately follow it
+static void heapCoalesce(size_t offset)
+{
+  heap_block_t* block = heapBlock(offset);
+  while (offset + block->size < _heapSize) {
+    heap_block_t* next = heapBlock(offset + block->size);
+    if (next->used) break;
+    block->size += next->size;
+  };
+}
+
+static void* heapMalloc(size_t size)
+{
+  if (size == 0) return nullptr;
+  size_t need = (size + HEAP_HEADER + HEAP_ALIGN - 1) & ~(size_t)(HEAP_ALIGN - 1);
+  for (size_t offset = 0; offset < _heapSize; offset += heapBlock(offset)->size) {
+    heap_block_t* block = heapBlock(offset);
+    if (block->used) continue;
+    heapCoalesce(offset);
+    if (block->size >= need) {
+      if (block->size - need >= HEAP_MIN) {
+        heap_block_t* rest = heapBlock(offset + need);
+        rest->size = block->size - need;
+        rest->used = 0;
+        block->size = need;
+      };
+      block->used = 1;
+      return _heap + offset + HEAP_HEADER;
+    };
+  };
+  return nullptr;
+}
+
+static void heapFree(void* ptr)
+{
+  if (!ptr) return;
+  size_t offset = (uint8_t*)ptr - _heap - HEAP_HEADER;
+  heapBlock(offset)->used = 0;
+  heapCoalesce(offset);
+}
+
+static void heapStats(size_t* free_size, size_t* largest)
+{
+  *free_size = 0;
+  *largest = 0;
+  for (size_t offset = 0; offset < _heapSize; offset += heapBlock(offset)->size) {
+    heap_block_t* block = heapBlock(offset);
+    if (block->used) continue;
+    heapCoalesce(offset);
+    size_t payload = block->size - HEAP_HEADER;
+    *free_size += payload;
+    if (payload > *largest) *largest = payload;
+  };
+}
+
+// Host replacements for esp_malloc() and heap_caps_*() used by src/reNvsAlloc.cpp
+
+extern "C" void* bench_heap_malloc(size_t size)
+{
+  return heapMalloc(size);
+}
+
+extern "C" void* heap_caps_malloc(size_t size, unsigned caps)
+{
+  return heapMalloc(size);
+}
+
+extern "C" void heap_caps_free(void* ptr)
+{
+  heapFree(ptr);
+}
+
+extern "C" size_t heap_caps_get_free_size(unsigned caps)
+{
+  size_t free_size, largest;
+  heapStats(&free_size, &largest);
+  return free_size;
+}
+
+extern "C" size_t heap_caps_get_largest_free_block(unsigned caps)
+{
+  size_t free_size, largest;
+  heapStats(&free_size, &largest);
+  return largest;
+}
+
+// Allocator for the "malloc" run: values go straight to the heap, as before the slab allocator existed
+
+static void* benchHeapAlloc(size_t size, void* arg)
+{
+  return heapMalloc(size);
+}
+
+static void benchHeapFree(void* ptr, void* arg)
+{
+  heapFree(ptr);
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// --------------------------------------------------- Workload ----------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+static uint32_t _rnd = 0;
+
+static uint32_t rnd()
+{
+  // xorshift32: the same sequence for both runs
+  _rnd ^= _rnd << 13;
+  _rnd ^= _rnd >> 17;
+  _rnd ^= _rnd << 5;
+  return _rnd;
+}
+
+static uint32_t rndRange(uint32_t min, uint32_t max)
+{
+  return min + rnd() % (max - min + 1);
+}
+
+// Value size of a parameter: integers and floats of 1..8 bytes, short and long strings
+static size_t paramSize(uint16_t index)
+{
+  uint16_t kind = index % 16;
+  if (kind < 4)  return 1;                  // i8 / u8 / bool
+  if (kind < 6)  return 2;                  // i16 / u16
+  if (kind < 10) return 4;                  // i32 / u32 / float / timespan
+  if (kind < 12) return 8;                  // i64 / u64 / double
+  if (kind < 15) return rndRange(6, 32);    // names, hostnames, topics
+  return rndRange(40, 120);                 // URLs, JSON fragments
+}
+
+typedef struct {
+  size_t   free_size;
+  size_t   largest;
+  size_t   largest_min;     // Smallest "largest free block" seen since the previous checkpoint
+  uint8_t  fragmentation;
+  uint8_t  fragmentation_avg;
+  uint32_t tls_failures;
+  uint32_t alloc_failures;
+} bench_point_t;
+
+typedef struct {
+  const char* name;
+  bench_point_t points[BENCH_STEPS / BENCH_CHECKPOINT];
+  nvs_value_alloc_stats_t final_stats;
+} bench_run_t;
+
+static void benchRun(bench_run_t* run, bool slab)
+{
+  void* params[BENCH_PARAMS] = { nullptr };
+  void* system[BENCH_SYSTEM_OBJECTS] = { nullptr };
+  void* transient = nullptr;
+  uint32_t tls_failures = 0;
+  uint32_t alloc_failures = 0;
+  size_t largest_min = SIZE_MAX;
+  uint32_t fragmentation_sum = 0;
+  uint32_t samples = 0;
+
+  _rnd = 0x2545F491;
+  heapReset(slab ? BENCH_HEAP_SIZE - BENCH_SLAB_ARENA_SIZE : BENCH_HEAP_SIZE);
+  if (slab) {
+    nvsValueSetAllocator(nullptr);
+  } else {
+    nvs_value_allocator_t allocator = { benchHeapAlloc, benchHeapFree, nullptr };
+    nvsValueSetAllocator(&allocator);
+  };
+
+  // Boot: all parameters are loaded from NVS while the rest of the system is starting
+  for (uint16_t i = 0; i < BENCH_PARAMS; i++) {
+    params[i] = nvsValueAlloc(paramSize(i));
+    if (!params[i]) alloc_failures++;
+    if (i % 4 == 0) {
+      uint16_t s = i / 4 % BENCH_SYSTEM_OBJECTS;
+      system[s] = heapMalloc(rndRange(16, 600));
+    };
+  };
+
+  for (uint32_t step = 1; step <= BENCH_STEPS; step++) {
+    // Parameter update from MQTT / web / commands: new value is allocated before the old one is released
+    uint16_t p = rnd() % BENCH_PARAMS;
+    void* value = nvsValueAlloc(paramSize(p));
+    if (value) {
+      nvsValueFree(params[p]);
+      params[p] = value;
+    } else {
+      alloc_failures++;
+    };
+
+    // Unrelated long-lived system objects are re-created from time to time
+    if (rnd() % 4 == 0) {
+      uint16_t s = rnd() % BENCH_SYSTEM_OBJECTS;
+      heapFree(system[s]);
+      system[s] = heapMalloc(rndRange(16, 600));
+    };
+
+    // Short-lived buffers (JSON, HTTP responses)
+    if (rnd() % 8 == 0) {
+      heapFree(transient);
+      transient = heapMalloc(rndRange(1024, 4096));
+    };
+
+    // TLS handshake needs one large contiguous block
+    if (step % BENCH_TLS_PERIOD == 0) {
+      size_t free_size, largest;
+      heapStats(&free_size, &largest);
+      if (largest < largest_min) largest_min = largest;
+      fragmentation_sum += 100 - largest * 100 / free_size;
+      samples++;
+
+      void* tls = heapMalloc(BENCH_TLS_SIZE);
+      if (tls) {
+        heapFree(tls);
+      } else {
+        tls_failures++;
+      };
+    };
+
+    if (step % BENCH_CHECKPOINT == 0) {
+      nvs_value_alloc_stats_t stats;
+      nvsValueGetStats(&stats);
+      bench_point_t* point = &run->points[step / BENCH_CHECKPOINT - 1];
+      point->free_size = stats.internal_free;
+      point->largest = stats.internal_largest;
+      point->largest_min = largest_min;
+      point->fragmentation = stats.fragmentation;
+      point->fragmentation_avg = fragmentation_sum / samples;
+      point->tls_failures = tls_failures;
+      point->alloc_failures = alloc_failures;
+      largest_min = SIZE_MAX;
+      fragmentation_sum = 0;
+      samples = 0;
+    };
+  };
+
+  nvsValueGetStats(&run->final_stats);
+
+  for (uint16_t i = 0; i < BENCH_PARAMS; i++) nvsValueFree(params[i]);
+  for (uint16_t i = 0; i < BENCH_SYSTEM_OBJECTS; i++) heapFree(system[i]);
+  heapFree(transient);
+}
+
+int main()
+{
+  static bench_run_t runs[2] = { { "malloc" }, { "slab" } };
+  benchRun(&runs[0], false);
+  benchRun(&runs[1], true);
+
+  printf("heap %u bytes, slab arena %u bytes (%u blocks per class), %u params, %u steps, 16 KB request every %u steps\n\n",
+    BENCH_HEAP_SIZE, BENCH_SLAB_ARENA_SIZE, CONFIG_NVS_VALUE_SLAB_BLOCKS, BENCH_PARAMS, BENCH_STEPS, BENCH_TLS_PERIOD);
+  printf("%8s | %-6s | %8s | %8s | %8s | %5s | %8s | %12s | %12s\n",
+    "step", "alloc", "free", "largest", "min larg", "frag", "avg frag", "16K failures", "val failures");
+  for (uint32_t i = 0; i < BENCH_STEPS / BENCH_CHECKPOINT; i++) {
+    for (uint8_t r = 0; r < 2; r++) {
+      bench_point_t* point = &runs[r].points[i];
+      printf("%8u | %-6s | %8zu | %8zu | %8zu | %4u%% | %7u%% | %12u | %12u\n",
+        (i + 1) * BENCH_CHECKPOINT, runs[r].name, point->free_size, point->largest, point->largest_min,
+        point->fragmentation, point->fragmentation_avg, point->tls_failures, point->alloc_failures);
+    };
+  };
+
+  printf("\nslab classes after the run (slab allocator):\n");
+  nvs_value_alloc_stats_t* stats = &runs[1].final_stats;
+  for (uint8_t i = 0; i < NVS_VALUE_SLAB_CLASSES; i++) {
+    printf("  %2u bytes: used %3u, peak %3u of %3u, overflows %u\n",
+      stats->slabs[i].block_size, stats->slabs[i].used, stats->slabs[i].peak, stats->slabs[i].blocks,
+      stats->slabs[i].overflows);
+  };
+  printf("  heap values: %u\n", stats->heap_allocs);
+  return 0;
+}
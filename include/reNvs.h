@@ -15,6 +15,38 @@
 #include "nvs.h"
 #include "nvs_flash.h"
 #include "rTypes.h"
+#include "project_config.h"
+
+#ifndef CONFIG_NVS_TRACE_ENABLE
+#define CONFIG_NVS_TRACE_ENABLE 0
+#endif // CONFIG_NVS_TRACE_ENABLE
+#ifndef CONFIG_NVS_TRACE_SIZE
+#define CONFIG_NVS_TRACE_SIZE 128
+#endif // CONFIG_NVS_TRACE_SIZE
+#ifndef CONFIG_NVS_INIT_TASK_STACK_SIZE
+#define CONFIG_NVS_INIT_TASK_STACK_SIZE 3072
+#endif // CONFIG_NVS_INIT_TASK_STACK_SIZE
+#ifndef CONFIG_NVS_INIT_TASK_PRIORITY
+#define CONFIG_NVS_INIT_TASK_PRIORITY 5
+#endif // CONFIG_NVS_INIT_TASK_PRIORITY
+#ifndef CONFIG_NVS_EARLY_READ_TIMEOUT
+#define CONFIG_NVS_EARLY_READ_TIMEOUT 1000
+#endif // CONFIG_NVS_EARLY_READ_TIMEOUT
+#ifndef CONFIG_NVS_DIAG_RING_SIZE
+#define CONFIG_NVS_DIAG_RING_SIZE 8
+#endif // CONFIG_NVS_DIAG_RING_SIZE
+#ifndef CONFIG_NVS_DIAG_VALUE_SIZE
+#define CONFIG_NVS_DIAG_VALUE_SIZE 16
+#endif // CONFIG_NVS_DIAG_VALUE_SIZE
+#ifndef CONFIG_NVS_VALUE_SLAB_ENABLE
+#define CONFIG_NVS_VALUE_SLAB_ENABLE 0
+#endif // CONFIG_NVS_VALUE_SLAB_ENABLE
+#ifndef CONFIG_NVS_VALUE_SLAB_BLOCKS
+#define CONFIG_NVS_VALUE_SLAB_BLOCKS 32
+#endif // CONFIG_NVS_VALUE_SLAB_BLOCKS
+#ifndef CONFIG_NVS_VALUE_PSRAM_THRESHOLD
+#define CONFIG_NVS_VALUE_PSRAM_THRESHOLD 0
+#endif // CONFIG_NVS_VALUE_PSRAM_THRESHOLD
 
 #ifdef __cplusplus
 extern "C" {
@@ -27,6 +59,57 @@ esp_err_t nvs_get_double(nvs_handle_t c_handle, const char* key, double* out_val
 esp_err_t nvs_set_time(nvs_handle_t c_handle, const char* key, time_t in_value);
 esp_err_t nvs_get_time(nvs_handle_t c_handle, const char* key, time_t* out_value);
 
+/**
+ * EN: Memory for parameter values. All values created by string2value(), clone2value(), setNewString() and nvsReadString()
+ *     are allocated through nvsValueAlloc() and must be released with nvsValueFree(). setNewString() and nvsReadString()
+ *     replace the caller's string pointer and release the previous one, so it must also come from nvsValueAlloc().
+ *     setNewValue() never reallocates strings: a new string longer than the current one is not copied.
+ *     nvsRead() never reallocates strings: a stored string longer than the current one is not read, the current value
+ *     is kept with a warning. With CONFIG_NVS_VALUE_SLAB_ENABLE scalars and short strings (up to 32 bytes) are taken
+ *     from static slabs of CONFIG_NVS_VALUE_SLAB_BLOCKS blocks per size class, so they do not fragment the heap.
+ *     Strings of CONFIG_NVS_VALUE_PSRAM_THRESHOLD bytes or more are placed in PSRAM if it is available. A custom
+ *     allocator must be set before the first value is allocated.
+ * RU: Память для значений параметров. Все значения, созданные string2value(), clone2value(), setNewString() и nvsReadString(),
+ *     выделяются через nvsValueAlloc() и должны освобождаться nvsValueFree(). setNewString() и nvsReadString() заменяют
+ *     указатель на строку и освобождают предыдущий, поэтому он тоже должен быть получен через nvsValueAlloc().
+ *     setNewValue() не перевыделяет строки: новая строка длиннее текущей не копируется.
+ *     nvsRead() не перевыделяет строки: сохранённая строка длиннее текущей не читается, текущее значение
+ *     сохраняется с предупреждением. При CONFIG_NVS_VALUE_SLAB_ENABLE скаляры и короткие строки (до 32 байт) берутся
+ *     из статических слэбов по CONFIG_NVS_VALUE_SLAB_BLOCKS блоков на класс размера и не фрагментируют кучу.
+ *     Строки от CONFIG_NVS_VALUE_PSRAM_THRESHOLD байт и длиннее размещаются в PSRAM, если она есть. Собственный
+ *     распределитель нужно установить до выделения первого значения.
+ **/
+#define NVS_VALUE_SLAB_CLASSES 6   // 1, 2, 4, 8, 16 and 32 bytes
+
+typedef struct {
+  void* (*alloc)(size_t size, void* arg);
+  void  (*free)(void* ptr, void* arg);
+  void* arg;
+} nvs_value_allocator_t;
+
+typedef struct {
+  uint16_t block_size;
+  uint16_t blocks;
+  uint16_t used;
+  uint16_t peak;
+  uint32_t overflows;     // Allocations passed to the heap because the slab was full
+} nvs_value_slab_stats_t;
+
+typedef struct {
+  nvs_value_slab_stats_t slabs[NVS_VALUE_SLAB_CLASSES];
+  uint32_t heap_allocs;   // Live blocks allocated in internal RAM
+  uint32_t psram_allocs;  // Live blocks allocated in PSRAM
+  size_t internal_free;
+  size_t internal_largest;
+  uint8_t fragmentation;  // 100 - largest free block * 100 / free internal RAM, %
+} nvs_value_alloc_stats_t;
+
+void  nvsValueSetAllocator(const nvs_value_allocator_t* allocator);
+void* nvsValueAlloc(size_t size);
+char* nvsValueStrdup(const char* str);
+void  nvsValueFree(void* value);
+void  nvsValueGetStats(nvs_value_alloc_stats_t* stats);
+
 uint16_t string2time(const char* str_value);
 char* time2string(uint16_t time);
 timespan_t string2timespan(const char* str_value);
@@ -38,12 +121,137 @@ void* clone2value(const param_type_t type_value, void *value);
 bool  equal2value(const param_type_t type_value, void *value1, void *value2);
 bool  valueCheckLimits(const param_type_t type_value, void *value, void *value_min, void *value_max);
 void  setNewValue(const param_type_t type_value, void *value1, void *value2);
+void  setNewString(void **value1, void *value2);
 
 bool nvsInit();
+
+/**
+ * EN: Staged initialization. nvsInitStart() initializes the partition in a background task (including erasing it on
+ *     NO_FREE_PAGES or NEW_VERSION_FOUND). nvsWrite() queues values until the partition becomes available. nvsRead()
+ *     first waits up to CONFIG_NVS_EARLY_READ_TIMEOUT ms (NVS_EARLY_READ_WAIT) or not at all (NVS_EARLY_READ_DEFAULTS);
+ *     if the partition is still not ready, it returns the queued value for the key, or keeps the default, and returns true. Callbacks registered with nvsOnReady() (also before nvsInitStart())
+ *     are called when nvsInitStart() or nvsInit() completes; if it has already been completed, the callback is called
+ *     immediately.
+ * RU: Поэтапная инициализация. nvsInitStart() инициализирует раздел в фоновой задаче (включая его очистку при
+ *     NO_FREE_PAGES или NEW_VERSION_FOUND). nvsWrite() ставит значения в очередь, пока раздел не станет доступен. nvsRead()
+ *     сначала ждёт до CONFIG_NVS_EARLY_READ_TIMEOUT мс (NVS_EARLY_READ_WAIT) или не ждёт вовсе (NVS_EARLY_READ_DEFAULTS);
+ *     если раздел всё ещё не готов, возвращает значение из очереди для ключа или оставляет значение по умолчанию и возвращает true. Обработчики nvsOnReady() (в том числе до nvsInitStart())
+ *     вызываются по завершении nvsInitStart() или nvsInit(); если инициализация уже завершена, обработчик
+ *     вызывается сразу.
+ **/
+typedef enum {
+  NVS_EARLY_READ_WAIT = 0,     // Wait for the partition up to CONFIG_NVS_EARLY_READ_TIMEOUT
+  NVS_EARLY_READ_DEFAULTS      // Use the queued or default value without waiting
+} nvs_early_read_t;
+
+typedef enum {
+  NVS_RECOVERY_NONE = 0,       // The partition was initialized on the first attempt
+  NVS_RECOVERY_NO_FREE_PAGES,  // The partition was erased: no free pages
+  NVS_RECOVERY_NEW_VERSION     // The partition was erased: new NVS version found
+} nvs_recovery_t;
+
+typedef struct {
+  esp_err_t result;
+  nvs_recovery_t recovery;
+  int64_t duration_us;
+} nvs_init_info_t;
+
+typedef void (*nvs_ready_cb_t)(esp_err_t result, void* arg);
+
+bool nvsInitStart(nvs_early_read_t early_read);
+bool nvsInitWait(uint32_t timeout_ms);
+bool nvsIsReady();
+bool nvsOnReady(nvs_ready_cb_t cb, void* arg);
+void nvsGetInitInfo(nvs_init_info_t* info);
+
 bool nvsOpen(const char* name_group, nvs_open_mode_t open_mode, nvs_handle_t *nvs_handle);
 bool nvsRead(const char* name_group, const char* name_key, const param_type_t type_value, void * value);
+bool nvsReadString(const char* name_group, const char* name_key, char** value);
 bool nvsWrite(const char* name_group, const char* name_key, const param_type_t type_value, void * value);
 
+/**
+ * EN: Diagnostics of nvsRead() and nvsWrite(). Events are stored as raw records in a small ring of
+ *     CONFIG_NVS_DIAG_RING_SIZE entries and are formatted only by the sink that consumes them. Events above
+ *     CONFIG_RLOG_PROJECT_LEVEL are not compiled at all.
+ * RU: Диагностика nvsRead() и nvsWrite(). События хранятся как необработанные записи в небольшом кольце на
+ *     CONFIG_NVS_DIAG_RING_SIZE элементов и форматируются только обработчиком, который их получает. События выше
+ *     CONFIG_RLOG_PROJECT_LEVEL не компилируются вовсе.
+ **/
+typedef enum {
+  NVS_DIAG_READ = 0,           // Value read from storage (or read error)
+  NVS_DIAG_READ_DEFAULT,       // Value not found in storage, default used
+  NVS_DIAG_WRITE               // Value written to storage (or write error)
+} nvs_diag_op_t;
+
+typedef struct {
+  uint8_t level;               // RLOG_LEVEL_*
+  uint8_t op;                  // nvs_diag_op_t
+  param_type_t type_value;
+  char name_group[NVS_KEY_NAME_MAX_SIZE];
+  char name_key[NVS_KEY_NAME_MAX_SIZE];
+  esp_err_t err;
+  uint8_t value[CONFIG_NVS_DIAG_VALUE_SIZE];  // Raw value bytes, strings are truncated
+} nvs_diag_record_t;
+
+typedef void (*nvs_diag_sink_t)(const nvs_diag_record_t* record, void* arg);
+
+void   nvsDiagSetSink(nvs_diag_sink_t sink, uint8_t level, void* arg);
+size_t nvsDiagFormatValue(const nvs_diag_record_t* record, char* buf, size_t size);
+size_t nvsDiagDump(nvs_diag_sink_t sink, void* arg);
+
+/**
+ * EN: Append-only record log with fixed capacity (ring of segments). Records are accumulated in RAM
+ *     and written to NVS as one blob per segment. Each segment carries a sequence number, so the newest
+ *     one is found with a single pass over the namespace at startup.
+ * RU: Журнал записей фиксированной ёмкости (кольцо сегментов). Записи накапливаются в ОЗУ и пишутся
+ *     в NVS одним blob-ом на сегмент. Каждый сегмент имеет порядковый номер, поэтому самый новый
+ *     находится за один проход по пространству имён при запуске.
+ **/
+typedef struct nvs_log_t* nvs_log_handle_t;
+
+typedef struct {
+  nvs_log_handle_t log;
+  uint32_t seq;          // Sequence number of the next segment to load
+  uint32_t seq_last;     // Sequence number of the newest segment at the time the cursor was created
+  uint16_t index;        // Index of the next record in the loaded segment
+  uint16_t count;        // Number of records in the loaded segment
+  uint8_t* segment;      // Buffer for one segment
+} nvs_log_cursor_t;
+
+nvs_log_handle_t nvsLogOpen(const char* name_group, uint16_t record_size, uint16_t records_per_segment, uint16_t segments);
+bool nvsLogAppend(nvs_log_handle_t log, const void* record);
+bool nvsLogFlush(nvs_log_handle_t log);
+void nvsLogClose(nvs_log_handle_t log);
+
+bool nvsLogCursorInit(nvs_log_handle_t log, nvs_log_cursor_t* cursor);
+bool nvsLogCursorNext(nvs_log_cursor_t* cursor, void* record);
+void nvsLogCursorFree(nvs_log_cursor_t* cursor);
+
+#if CONFIG_NVS_TRACE_ENABLE
+/**
+ * EN: Tracing of NVS operations. Each call is stored as a span (operation, namespace, key, start, duration, result)
+ *     in a lock-free ring buffer of CONFIG_NVS_TRACE_SIZE entries. The buffer can be exported as Chrome trace JSON
+ *     (chrome://tracing, Perfetto) through any writer: a file on the host, UART or a network stream on the device.
+ * RU: Трассировка операций NVS. Каждый вызов сохраняется как интервал (операция, пространство имён, ключ, начало,
+ *     длительность, результат) в кольцевом буфере без блокировок на CONFIG_NVS_TRACE_SIZE записей. Буфер можно
+ *     выгрузить в формате Chrome trace JSON через любой обработчик: в файл на хосте, в UART или в сеть на устройстве.
+ **/
+typedef enum {
+  NVS_TRACE_OPEN = 0,
+  NVS_TRACE_GET,
+  NVS_TRACE_SET,
+  NVS_TRACE_COMMIT,
+  NVS_TRACE_FLASH_INIT,
+  NVS_TRACE_FLASH_ERASE
+} nvs_trace_op_t;
+
+typedef void (*nvs_trace_writer_t)(const char* data, void* arg);
+
+void nvsTraceClear();
+size_t nvsTraceExport(nvs_trace_writer_t writer, void* arg);
+size_t nvsTraceExportFile(FILE* stream);
+#endif // CONFIG_NVS_TRACE_ENABLE
+
 #ifdef __cplusplus
 }
 #endif
@@ -9,17 +9,321 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/semphr.h>
 #include <freertos/task.h>
+#include <freertos/event_groups.h>
 #include "sys/queue.h"
 #include "nvs.h"
 #include "nvs_flash.h"
 #include "nvs_handle.hpp"
 #include "project_config.h"
 #include "def_consts.h"
+#include <atomic>
+#include "esp_timer.h"
 
 #if CONFIG_RLOG_PROJECT_LEVEL > RLOG_LEVEL_NONE
 static const char * logTAG = "NVS";
 #endif // CONFIG_RLOG_PROJECT_LEVEL
 
+// -----------------------------------------------------------------------------------------------------------------------
+// --------------------------------------------------- Tracing -----------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if CONFIG_NVS_TRACE_ENABLE
+
+typedef struct {
+  std::atomic<uint32_t> seq;      // 0 - the entry is being written
+  uint8_t op;
+  esp_err_t result;
+  uint32_t task;
+  int64_t start;
+  uint32_t duration;
+  char name_group[NVS_KEY_NAME_MAX_SIZE];
+  char name_key[NVS_KEY_NAME_MAX_SIZE];
+} nvs_trace_span_t;
+
+static nvs_trace_span_t _nvsTrace[CONFIG_NVS_TRACE_SIZE];
+static std::atomic<uint32_t> _nvsTraceHead(0);
+
+static const char* nvsTraceOpName(uint8_t op)
+{
+  switch (op) {
+    case NVS_TRACE_OPEN:        return "open";
+    case NVS_TRACE_GET:         return "get";
+    case NVS_TRACE_SET:         return "set";
+    case NVS_TRACE_COMMIT:      return "commit";
+    case NVS_TRACE_FLASH_INIT:  return "flash_init";
+    case NVS_TRACE_FLASH_ERASE: return "flash_erase";
+    default:                    return "unknown";
+  };
+}
+
+static void nvsTraceName(char* dest, const char* src)
+{
+  size_t i = 0;
+  if (src) {
+    // NVS names are short, but quotes and backslashes would break JSON
+    for (; (i < NVS_KEY_NAME_MAX_SIZE - 1) && (src[i]); i++) {
+      dest[i] = ((src[i] == '"') || (src[i] == '\\')) ? '_' : src[i];
+    };
+  };
+  dest[i] = 0;
+}
+
+static void nvsTraceSpan(nvs_trace_op_t op, const char* name_group, const char* name_key, int64_t start, esp_err_t result)
+{
+  int64_t now = esp_timer_get_time();
+  uint32_t seq = _nvsTraceHead.fetch_add(1, std::memory_order_relaxed) + 1;
+  nvs_trace_span_t* span = &_nvsTrace[(seq - 1) % CONFIG_NVS_TRACE_SIZE];
+  span->seq.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  span->op = (uint8_t)op;
+  span->result = result;
+  span->task = (uint32_t)(uintptr_t)xTaskGetCurrentTaskHandle();
+  span->start = start;
+  span->duration = (uint32_t)(now - start);
+  nvsTraceName(span->name_group, name_group);
+  nvsTraceName(span->name_key, name_key);
+  span->seq.store(seq, std::memory_order_release);
+}
+
+void nvsTraceClear()
+{
+  for (size_t i = 0; i < CONFIG_NVS_TRACE_SIZE; i++) {
+    _nvsTrace[i].seq.store(0, std::memory_order_relaxed);
+  };
+  _nvsTraceHead.store(0, std::memory_order_release);
+}
+
+size_t nvsTraceExport(nvs_trace_writer_t writer, void* arg)
+{
+  if (!writer) return 0;
+
+  size_t count = 0;
+  char buf[256];
+  uint32_t head = _nvsTraceHead.load(std::memory_order_acquire);
+  uint32_t seq = head > CONFIG_NVS_TRACE_SIZE ? head - CONFIG_NVS_TRACE_SIZE + 1 : 1;
+  writer("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", arg);
+  for (; seq <= head; seq++) {
+    nvs_trace_span_t* span = &_nvsTrace[(seq - 1) % CONFIG_NVS_TRACE_SIZE];
+    if (span->seq.load(std::memory_order_acquire) != seq) continue;
+    nvs_trace_span_t copy;
+    copy.op = span->op;
+    copy.result = span->result;
+    copy.task = span->task;
+    copy.start = span->start;
+    copy.duration = span->duration;
+    memcpy(copy.name_group, span->name_group, NVS_KEY_NAME_MAX_SIZE);
+    memcpy(copy.name_key, span->name_key, NVS_KEY_NAME_MAX_SIZE);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    // The entry was overwritten while copying
+    if (span->seq.load(std::memory_order_relaxed) != seq) continue;
+    copy.name_group[NVS_KEY_NAME_MAX_SIZE - 1] = 0;
+    copy.name_key[NVS_KEY_NAME_MAX_SIZE - 1] = 0;
+
+    snprintf(buf, sizeof(buf), 
+      "%s{\"name\":\"%s\",\"cat\":\"nvs\",\"ph\":\"X\",\"pid\":1,\"tid\":%" PRIu32 ",\"ts\":%" PRId64 ",\"dur\":%" PRIu32 
+      ",\"args\":{\"group\":\"%s\",\"key\":\"%s\",\"result\":\"%s\"}}",
+      count > 0 ? "," : "", nvsTraceOpName(copy.op), copy.task, copy.start, copy.duration, 
+      copy.name_group, copy.name_key, esp_err_to_name(copy.result));
+    writer(buf, arg);
+    count++;
+  };
+  writer("]}\n", arg);
+  return count;
+}
+
+static void nvsTraceWriteFile(const char* data, void* arg)
+{
+  fputs(data, (FILE*)arg);
+}
+
+size_t nvsTraceExportFile(FILE* stream)
+{
+  if (!stream) return 0;
+  return nvsTraceExport(nvsTraceWriteFile, stream);
+}
+
+#define NVS_TRACE_START(var) int64_t var = esp_timer_get_time()
+#define NVS_TRACE_STOP(var, op, name_group, name_key, err) nvsTraceSpan(op, name_group, name_key, var, err)
+
+#else
+
+#define NVS_TRACE_START(var)
+#define NVS_TRACE_STOP(var, op, name_group, name_key, err)
+
+#endif // CONFIG_NVS_TRACE_ENABLE
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------- Diagnostics ---------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if CONFIG_RLOG_PROJECT_LEVEL > RLOG_LEVEL_NONE
+
+static nvs_diag_record_t _nvsDiag[CONFIG_NVS_DIAG_RING_SIZE];
+static uint32_t _nvsDiagHead = 0;
+static portMUX_TYPE _nvsDiagMux = portMUX_INITIALIZER_UNLOCKED;
+
+static size_t nvsDiagValueSize(const param_type_t type_value)
+{
+  switch (type_value) {
+    case OPT_TYPE_I8:       return sizeof(int8_t);
+    case OPT_TYPE_U8:       return sizeof(uint8_t);
+    case OPT_TYPE_I16:      return sizeof(int16_t);
+    case OPT_TYPE_U16:      return sizeof(uint16_t);
+    case OPT_TYPE_I32:      return sizeof(int32_t);
+    case OPT_TYPE_U32:      return sizeof(uint32_t);
+    case OPT_TYPE_I64:      return sizeof(int64_t);
+    case OPT_TYPE_U64:      return sizeof(uint64_t);
+    case OPT_TYPE_FLOAT:    return sizeof(float);
+    case OPT_TYPE_DOUBLE:   return sizeof(double);
+    case OPT_TYPE_TIMEVAL:  return sizeof(uint16_t);
+    case OPT_TYPE_TIMESPAN: return sizeof(timespan_t);
+    default:                return 0;
+  };
+}
+
+size_t nvsDiagFormatValue(const nvs_diag_record_t* record, char* buf, size_t size)
+{
+  if ((!record) || (!buf) || (size == 0)) return 0;
+
+  int len = 0;
+  const void* value = record->value;
+  switch (record->type_value) {
+    case OPT_TYPE_I8:       len = snprintf(buf, size, CONFIG_FORMAT_OPT_I8, *(int8_t*)value); break;
+    case OPT_TYPE_U8:       len = snprintf(buf, size, CONFIG_FORMAT_OPT_U8, *(uint8_t*)value); break;
+    case OPT_TYPE_I16:      len = snprintf(buf, size, CONFIG_FORMAT_OPT_I16, *(int16_t*)value); break;
+    case OPT_TYPE_U16:      len = snprintf(buf, size, CONFIG_FORMAT_OPT_U16, *(uint16_t*)value); break;
+    case OPT_TYPE_I32:      len = snprintf(buf, size, CONFIG_FORMAT_OPT_I32, *(int32_t*)value); break;
+    case OPT_TYPE_U32:      len = snprintf(buf, size, CONFIG_FORMAT_OPT_U32, *(uint32_t*)value); break;
+    case OPT_TYPE_I64:      len = snprintf(buf, size, CONFIG_FORMAT_OPT_I64, *(int64_t*)value); break;
+    case OPT_TYPE_U64:      len = snprintf(buf, size, CONFIG_FORMAT_OPT_U64, *(uint64_t*)value); break;
+    case OPT_TYPE_FLOAT:    len = snprintf(buf, size, CONFIG_FORMAT_OPT_FLOAT, *(float*)value); break;
+    case OPT_TYPE_DOUBLE:   len = snprintf(buf, size, CONFIG_FORMAT_OPT_DOUBLE, *(double*)value); break;
+    case OPT_TYPE_STRING:   len = snprintf(buf, size, "%.*s", CONFIG_NVS_DIAG_VALUE_SIZE, (const char*)value); break;
+    case OPT_TYPE_TIMEVAL:  
+      len = snprintf(buf, size, CONFIG_FORMAT_TIMEINT, *(uint16_t*)value / 100, *(uint16_t*)value % 100); 
+      break;
+    case OPT_TYPE_TIMESPAN: {
+      uint32_t t1 = *(timespan_t*)value / 10000;
+      uint32_t t2 = *(timespan_t*)value % 10000;
+      len = snprintf(buf, size, CONFIG_FORMAT_TIMESPAN, t1 / 100, t1 % 100, t2 / 100, t2 % 100);
+      break;
+    };
+    default:
+      buf[0] = 0;
+      break;
+  };
+  if (len < 0) len = 0;
+  return (size_t)len < size ? (size_t)len : size - 1;
+}
+
+static void nvsDiagLogSink(const nvs_diag_record_t* record, void* arg)
+{
+  char str_value[CONFIG_NVS_DIAG_VALUE_SIZE * 2 + 8];
+  const char* name_group = record->name_group;
+  const char* name_key = record->name_key;
+  if (record->err == ESP_OK || record->err == ESP_ERR_NVS_NOT_FOUND) {
+    nvsDiagFormatValue(record, str_value, sizeof(str_value));
+    switch (record->op) {
+      case NVS_DIAG_READ:
+        rlog_d(logTAG, "Read value \"%s.%s\": [%s]", name_group, name_key, str_value);
+        break;
+      case NVS_DIAG_READ_DEFAULT:
+        rlog_d(logTAG, "Value \"%s.%s\" is not initialized yet, used default: [%s]", name_group, name_key, str_value);
+        break;
+      case NVS_DIAG_WRITE:
+        rlog_i(logTAG, "Value \"%s.%s\" was successfully written to storage", name_group, name_key);
+        break;
+    };
+  } else {
+    const char* action = record->op == NVS_DIAG_WRITE ? "writting" : "reading";
+    if (record->level == RLOG_LEVEL_WARN) {
+      rlog_w(logTAG, "Error %s \"%s.%s\": %d (%s)!", action, name_group, name_key, record->err, esp_err_to_name(record->err));
+    } else {
+      rlog_e(logTAG, "Error %s \"%s.%s\": %d (%s)!", action, name_group, name_key, record->err, esp_err_to_name(record->err));
+    };
+  };
+}
+
+static nvs_diag_sink_t _nvsDiagSink = nvsDiagLogSink;
+static uint8_t _nvsDiagLevel = CONFIG_RLOG_PROJECT_LEVEL;
+static void* _nvsDiagArg = nullptr;
+
+void nvsDiagSetSink(nvs_diag_sink_t sink, uint8_t level, void* arg)
+{
+  portENTER_CRITICAL(&_nvsDiagMux);
+  _nvsDiagSink = sink ? sink : nvsDiagLogSink;
+  _nvsDiagLevel = level;
+  _nvsDiagArg = arg;
+  portEXIT_CRITICAL(&_nvsDiagMux);
+}
+
+static void nvsDiagPush(uint8_t level, nvs_diag_op_t op, const char* name_group, const char* name_key, 
+  const param_type_t type_value, const void* value, esp_err_t err)
+{
+  nvs_diag_record_t record;
+  record.level = level;
+  record.op = (uint8_t)op;
+  record.type_value = type_value;
+  // Names are copied: the record can be dumped long after the caller's strings are gone
+  strncpy(record.name_group, name_group ? name_group : "", sizeof(record.name_group) - 1);
+  record.name_group[sizeof(record.name_group) - 1] = 0;
+  strncpy(record.name_key, name_key ? name_key : "", sizeof(record.name_key) - 1);
+  record.name_key[sizeof(record.name_key) - 1] = 0;
+  record.err = err;
+  memset(record.value, 0, sizeof(record.value));
+  if (value) {
+    if (type_value == OPT_TYPE_STRING) {
+      strncpy((char*)record.value, (const char*)value, sizeof(record.value));
+    } else {
+      memcpy(record.value, value, nvsDiagValueSize(type_value));
+    };
+  };
+
+  portENTER_CRITICAL(&_nvsDiagMux);
+  _nvsDiag[_nvsDiagHead % CONFIG_NVS_DIAG_RING_SIZE] = record;
+  _nvsDiagHead++;
+  nvs_diag_sink_t sink = level <= _nvsDiagLevel ? _nvsDiagSink : nullptr;
+  void* arg = _nvsDiagArg;
+  portEXIT_CRITICAL(&_nvsDiagMux);
+
+  if (sink) sink(&record, arg);
+}
+
+size_t nvsDiagDump(nvs_diag_sink_t sink, void* arg)
+{
+  nvs_diag_record_t records[CONFIG_NVS_DIAG_RING_SIZE];
+  size_t count = 0;
+
+  portENTER_CRITICAL(&_nvsDiagMux);
+  if (!sink) {
+    sink = _nvsDiagSink;
+    arg = _nvsDiagArg;
+  };
+  uint32_t seq = _nvsDiagHead > CONFIG_NVS_DIAG_RING_SIZE ? _nvsDiagHead - CONFIG_NVS_DIAG_RING_SIZE : 0;
+  for (; seq < _nvsDiagHead; seq++) {
+    records[count++] = _nvsDiag[seq % CONFIG_NVS_DIAG_RING_SIZE];
+  };
+  portEXIT_CRITICAL(&_nvsDiagMux);
+
+  for (size_t i = 0; i < count; i++) {
+    sink(&records[i], arg);
+  };
+  return count;
+}
+
+#define NVS_DIAG(level, op, name_group, name_key, type_value, value, err) \
+  do { if (CONFIG_RLOG_PROJECT_LEVEL >= (level)) nvsDiagPush(level, op, name_group, name_key, type_value, value, err); } while (0)
+
+#else
+
+void nvsDiagSetSink(nvs_diag_sink_t sink, uint8_t level, void* arg) {}
+size_t nvsDiagFormatValue(const nvs_diag_record_t* record, char* buf, size_t size) { return 0; }
+size_t nvsDiagDump(nvs_diag_sink_t sink, void* arg) { return 0; }
+
+#define NVS_DIAG(level, op, name_group, name_key, type_value, value, err)
+
+#endif // CONFIG_RLOG_PROJECT_LEVEL
+
 esp_err_t nvs_set_float(nvs_handle_t c_handle, const char* key, float in_value)
 {
   uint32_t buf = 0;
@@ -165,76 +469,76 @@ void* string2value(const param_type_t type_value, char* str_value)
   if (str_value) {
     switch (type_value) {
       case OPT_TYPE_I8:
-        value = esp_malloc(sizeof(int8_t));
+        value = nvsValueAlloc(sizeof(int8_t));
         if (value) {
           *(int8_t*)value = (int8_t)strtoimax(str_value, nullptr, 0);
         };
         break;
       case OPT_TYPE_U8:
-        value = esp_malloc(sizeof(uint8_t));
+        value = nvsValueAlloc(sizeof(uint8_t));
         if (value) {
           *(uint8_t*)value = (uint8_t)strtoumax(str_value, nullptr, 0);
         };
         break;
       case OPT_TYPE_I16:
-        value = esp_malloc(sizeof(int16_t));
+        value = nvsValueAlloc(sizeof(int16_t));
         if (value) {
           *(int16_t*)value = (int16_t)strtoimax(str_value, nullptr, 0);
         };
         break;
       case OPT_TYPE_U16:
-        value = esp_malloc(sizeof(uint16_t));
+        value = nvsValueAlloc(sizeof(uint16_t));
         if (value) {
           *(uint16_t*)value = (uint16_t)strtoumax(str_value, nullptr, 0);
         };
         break;
       case OPT_TYPE_I32:
-        value = esp_malloc(sizeof(int32_t));
+        value = nvsValueAlloc(sizeof(int32_t));
         if (value) {
           *(int32_t*)value = (int32_t)strtoimax(str_value, nullptr, 0);
         };
         break;
       case OPT_TYPE_U32:
-        value = esp_malloc(sizeof(uint32_t));
+        value = nvsValueAlloc(sizeof(uint32_t));
         if (value) {
           *(uint32_t*)value = (uint32_t)strtoumax(str_value, nullptr, 0);
         };
         break;
       case OPT_TYPE_I64:
-        value = esp_malloc(sizeof(int64_t));
+        value = nvsValueAlloc(sizeof(int64_t));
         if (value) {
           *(uint64_t*)value = (uint64_t)strtoumax(str_value, nullptr, 0);
         };
         break;
       case OPT_TYPE_U64:
-        value = esp_malloc(sizeof(uint64_t));
+        value = nvsValueAlloc(sizeof(uint64_t));
         if (value) {
           *(uint64_t*)value = (uint64_t)strtoumax(str_value, nullptr, 0);
         };
         break;
       case OPT_TYPE_FLOAT:
-        value = esp_malloc(sizeof(float));
+        value = nvsValueAlloc(sizeof(float));
         if (value) {
           *(float*)value = (float)strtof(str_value, nullptr);
         };
         break;
       case OPT_TYPE_DOUBLE:
-        value = esp_malloc(sizeof(double));
+        value = nvsValueAlloc(sizeof(double));
         if (value) {
           *(double*)value = (double)strtod(str_value, nullptr);
         };
         break;
       case OPT_TYPE_STRING:
-        value = strdup(str_value);
+        value = nvsValueStrdup(str_value);
         break;
       case OPT_TYPE_TIMEVAL:
-        value = esp_malloc(sizeof(uint16_t));
+        value = nvsValueAlloc(sizeof(uint16_t));
         if (value) {
           *(uint16_t*)value = string2time(str_value);
         };
         break;
       case OPT_TYPE_TIMESPAN:
-        value = esp_malloc(sizeof(uint32_t));
+        value = nvsValueAlloc(sizeof(uint32_t));
         if (value) {
           *(timespan_t*)value = string2timespan(str_value);
         };
@@ -252,76 +556,76 @@ void* clone2value(const param_type_t type_value, void *value)
   if (value) {
     switch (type_value) {
       case OPT_TYPE_I8:
-        value2 = esp_malloc(sizeof(int8_t));
+        value2 = nvsValueAlloc(sizeof(int8_t));
         if (value) {
           *(int8_t*)value2 = *(int8_t*)value;
         };
         break;
       case OPT_TYPE_U8:
-        value2 = esp_malloc(sizeof(uint8_t));
+        value2 = nvsValueAlloc(sizeof(uint8_t));
         if (value) {
           *(uint8_t*)value2 = *(uint8_t*)value;
         };
         break;
       case OPT_TYPE_I16:
-        value2 = esp_malloc(sizeof(int16_t));
+        value2 = nvsValueAlloc(sizeof(int16_t));
         if (value) {
           *(int16_t*)value2 = *(int16_t*)value;
         };
         break;
       case OPT_TYPE_U16:
-        value2 = esp_malloc(sizeof(uint16_t));
+        value2 = nvsValueAlloc(sizeof(uint16_t));
         if (value) {
           *(uint16_t*)value2 = *(uint16_t*)value;
         };
         break;
       case OPT_TYPE_I32:
-        value2 = esp_malloc(sizeof(int32_t));
+        value2 = nvsValueAlloc(sizeof(int32_t));
         if (value) {
           *(int32_t*)value2 = *(int32_t*)value;
         };
         break;
       case OPT_TYPE_U32:
-        value2 = esp_malloc(sizeof(uint32_t));
+        value2 = nvsValueAlloc(sizeof(uint32_t));
         if (value) {
           *(uint32_t*)value2 = *(uint32_t*)value;
         };
         break;
       case OPT_TYPE_I64:
-        value2 = esp_malloc(sizeof(int64_t));
+        value2 = nvsValueAlloc(sizeof(int64_t));
         if (value) {
           *(int64_t*)value2 = *(int64_t*)value;
         };
         break;
       case OPT_TYPE_U64:
-        value2 = esp_malloc(sizeof(uint64_t));
+        value2 = nvsValueAlloc(sizeof(uint64_t));
         if (value) {
           *(uint64_t*)value2 = *(uint64_t*)value;
         };
         break;
       case OPT_TYPE_FLOAT:
-        value2 = esp_malloc(sizeof(float));
+        value2 = nvsValueAlloc(sizeof(float));
         if (value) {
           *(float*)value2 = *(float*)value;
         };
         break;
       case OPT_TYPE_DOUBLE:
-        value2 = esp_malloc(sizeof(double));
+        value2 = nvsValueAlloc(sizeof(double));
         if (value) {
           *(double*)value2 = *(double*)value;
         };
         break;
       case OPT_TYPE_STRING:
-        value2 = strdup((char*)value);
+        value2 = nvsValueStrdup((char*)value);
         break;
       case OPT_TYPE_TIMEVAL:
-        value2 = esp_malloc(sizeof(uint16_t));
+        value2 = nvsValueAlloc(sizeof(uint16_t));
         if (value) {
           *(uint16_t*)value2 = *(uint16_t*)value;
         };
         break;
       case OPT_TYPE_TIMESPAN:
-        value2 = esp_malloc(sizeof(timespan_t));
+        value2 = nvsValueAlloc(sizeof(timespan_t));
         if (value) {
           *(timespan_t*)value2 = *(timespan_t*)value;
         };
@@ -442,8 +746,12 @@ void setNewValue(const param_type_t type_value, void *value1, void *value2)
         *(double*)value1 = *(double*)value2;
         return;
       case OPT_TYPE_STRING:
-        if (value1) free(value1);
-        value1 = strdup((char*)value2);
+        // The caller's pointer cannot be replaced here, so the string is copied only into the existing buffer
+        if (strlen((char*)value2) <= strlen((char*)value1)) {
+          strcpy((char*)value1, (char*)value2);
+        } else {
+          rlog_w(logTAG, "New string value does not fit into the current buffer, use setNewString()");
+        };
         return;
       case OPT_TYPE_TIMEVAL:
         *(uint16_t*)value1 = *(uint16_t*)value2;
@@ -457,31 +765,377 @@ void setNewValue(const param_type_t type_value, void *value1, void *value2)
   };
 }
 
-static bool _nvsInit = false;
+void setNewString(void **value1, void *value2)
+{
+  if ((value1) && (value2)) {
+    // The caller's pointer is replaced only if the copy was successful
+    char* str_value = nvsValueStrdup((char*)value2);
+    if (str_value) {
+      nvsValueFree(*value1);
+      *value1 = str_value;
+    };
+  };
+}
+
+static std::atomic<bool> _nvsInit(false);
+static nvs_init_info_t _nvsInitInfo = { ESP_ERR_INVALID_STATE, NVS_RECOVERY_NONE, 0 };
 
-bool nvsInit()
+static esp_err_t nvsFlashInit()
 {
-  if (!_nvsInit) {
-    esp_err_t err = nvs_flash_init();
-    if ((err == ESP_ERR_NVS_NO_FREE_PAGES) || (err == ESP_ERR_NVS_NEW_VERSION_FOUND)) {
-      rlog_i(logTAG, "Erasing NVS partition...");
-      nvs_flash_erase();
-      err = nvs_flash_init();
+  int64_t start = esp_timer_get_time();
+  _nvsInitInfo.recovery = NVS_RECOVERY_NONE;
+  NVS_TRACE_START(t_init);
+  esp_err_t err = nvs_flash_init();
+  NVS_TRACE_STOP(t_init, NVS_TRACE_FLASH_INIT, nullptr, nullptr, err);
+  if ((err == ESP_ERR_NVS_NO_FREE_PAGES) || (err == ESP_ERR_NVS_NEW_VERSION_FOUND)) {
+    _nvsInitInfo.recovery = err == ESP_ERR_NVS_NO_FREE_PAGES ? NVS_RECOVERY_NO_FREE_PAGES : NVS_RECOVERY_NEW_VERSION;
+    rlog_i(logTAG, "Erasing NVS partition...");
+    NVS_TRACE_START(t_erase);
+    esp_err_t err_erase = nvs_flash_erase();
+    NVS_TRACE_STOP(t_erase, NVS_TRACE_FLASH_ERASE, nullptr, nullptr, err_erase);
+    (void)err_erase;
+    NVS_TRACE_START(t_reinit);
+    err = nvs_flash_init();
+    NVS_TRACE_STOP(t_reinit, NVS_TRACE_FLASH_INIT, nullptr, nullptr, err);
+  };
+  _nvsInitInfo.result = err;
+  _nvsInitInfo.duration_us = esp_timer_get_time() - start;
+  if (err == ESP_OK) {
+    rlog_i(logTAG, "NVS partition initilized in %" PRId64 " ms (recovery: %d)", _nvsInitInfo.duration_us / 1000, _nvsInitInfo.recovery);
+  }
+  else {
+    rlog_e(logTAG, "NVS partition initialization error: %d (%s)", err, esp_err_to_name(err));
+  };
+  return err;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ----------------------------------------------- Staged initialization -------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#define NVS_INIT_DONE_BIT BIT0
+
+typedef struct nvs_ready_item_t {
+  nvs_ready_cb_t cb;
+  void* arg;
+  STAILQ_ENTRY(nvs_ready_item_t) next;
+} nvs_ready_item_t;
+STAILQ_HEAD(nvs_ready_head_t, nvs_ready_item_t);
+
+typedef struct nvs_pending_item_t {
+  char* name_group;
+  char* name_key;
+  param_type_t type_value;
+  void* value;
+  STAILQ_ENTRY(nvs_pending_item_t) next;
+} nvs_pending_item_t;
+STAILQ_HEAD(nvs_pending_head_t, nvs_pending_item_t);
+
+static EventGroupHandle_t _nvsInitEvents = nullptr;
+static std::atomic<TaskHandle_t> _nvsInitTask(nullptr);
+static std::atomic<SemaphoreHandle_t> _nvsInitLock(nullptr);
+static bool _nvsInitDone = false;
+static nvs_early_read_t _nvsEarlyRead = NVS_EARLY_READ_WAIT;
+static nvs_ready_head_t _nvsReadyList = STAILQ_HEAD_INITIALIZER(_nvsReadyList);
+static nvs_pending_head_t _nvsPendingList = STAILQ_HEAD_INITIALIZER(_nvsPendingList);
+static nvs_pending_item_t* _nvsPendingActive = nullptr;
+
+static bool nvsWriteValue(const char* name_group, const char* name_key, const param_type_t type_value, void * value);
+
+// The lock is created on first use: callbacks can be registered before nvsInitStart()
+static SemaphoreHandle_t nvsInitLock()
+{
+  SemaphoreHandle_t lock = _nvsInitLock.load();
+  if (!lock) {
+    SemaphoreHandle_t created = xSemaphoreCreateMutex();
+    RE_MEM_CHECK(created, return nullptr);
+    if (_nvsInitLock.compare_exchange_strong(lock, created)) {
+      lock = created;
+    } else {
+      vSemaphoreDelete(created);
     };
-    if (err == ESP_OK) {
-      _nvsInit = true;
-      rlog_i(logTAG, "NVS partition initilized");
-    }
-    else {
-      rlog_e(logTAG, "NVS partition initialization error: %d (%s)", err, esp_err_to_name(err));
+  };
+  return lock;
+}
+
+// Marks initialization as completed and takes the registered callbacks, called under the init lock
+static void nvsInitFinish(nvs_ready_head_t* ready_list)
+{
+  _nvsInitDone = true;
+  STAILQ_CONCAT(ready_list, &_nvsReadyList);
+  if (_nvsInitEvents) {
+    xEventGroupSetBits(_nvsInitEvents, NVS_INIT_DONE_BIT);
+  };
+}
+
+// Calls the callbacks taken by nvsInitFinish(), outside the init lock
+static void nvsInitComplete(esp_err_t err, nvs_ready_head_t* ready_list)
+{
+  while (!STAILQ_EMPTY(ready_list)) {
+    nvs_ready_item_t* item = STAILQ_FIRST(ready_list);
+    STAILQ_REMOVE_HEAD(ready_list, next);
+    item->cb(err, item->arg);
+    free(item);
+  };
+}
+
+static void nvsPendingFree(nvs_pending_item_t* item)
+{
+  if (item->name_group) free(item->name_group);
+  if (item->name_key) free(item->name_key);
+  if (item->value) nvsValueFree(item->value);
+  free(item);
+}
+
+// Returns true if the value was queued until the partition becomes available
+static bool nvsPendingWrite(const char* name_group, const char* name_key, const param_type_t type_value, void * value, bool* result)
+{
+  if (!_nvsInitEvents) return false;
+
+  SemaphoreHandle_t lock = nvsInitLock();
+  xSemaphoreTake(lock, portMAX_DELAY);
+  if (_nvsInitDone) {
+    xSemaphoreGive(lock);
+    return false;
+  };
+
+  // Only the last value written to the key matters
+  nvs_pending_item_t* item;
+  STAILQ_FOREACH(item, &_nvsPendingList, next) {
+    if ((item->type_value == type_value) && (strcmp(item->name_key, name_key) == 0) 
+     && (strcmp(item->name_group, name_group) == 0)) break;
+  };
+  void* clone = clone2value(type_value, value);
+  if (clone) {
+    if (item) {
+      nvsValueFree(item->value);
+      item->value = clone;
+    } else {
+      item = (nvs_pending_item_t*)esp_malloc(sizeof(nvs_pending_item_t));
+      if (item) {
+        memset(item, 0, sizeof(nvs_pending_item_t));
+        item->name_group = strdup(name_group);
+        item->name_key = strdup(name_key);
+        item->type_value = type_value;
+        item->value = clone;
+        if ((item->name_group) && (item->name_key)) {
+          STAILQ_INSERT_TAIL(&_nvsPendingList, item, next);
+        } else {
+          nvsPendingFree(item);
+          item = nullptr;
+        };
+      } else {
+        nvsValueFree(clone);
+      };
+    };
+  };
+  *result = (clone) && (item);
+  xSemaphoreGive(lock);
+
+  if (*result) {
+    rlog_d(logTAG, "NVS partition is not ready yet, value \"%s.%s\" queued for writing", name_group, name_key);
+  } else {
+    rlog_e(logTAG, "Failed to queue value \"%s.%s\": out of memory!", name_group, name_key);
+  };
+  return true;
+}
+
+// Returns true if the partition is not ready yet and the read was served from the queue or the default was kept
+static bool nvsPendingRead(const char* name_group, const char* name_key, const param_type_t type_value, void * value, char** str_ref)
+{
+  if (!_nvsInitEvents) return false;
+
+  SemaphoreHandle_t lock = nvsInitLock();
+  xSemaphoreTake(lock, portMAX_DELAY);
+  if (_nvsInitDone) {
+    xSemaphoreGive(lock);
+    return false;
+  };
+
+  // The queue holds newer values than the item that is being written by the init task right now
+  nvs_pending_item_t* item;
+  STAILQ_FOREACH(item, &_nvsPendingList, next) {
+    if ((item->type_value == type_value) && (strcmp(item->name_key, name_key) == 0) 
+     && ((name_group) && (strcmp(item->name_group, name_group) == 0))) break;
+  };
+  if ((!item) && (_nvsPendingActive) && (_nvsPendingActive->type_value == type_value) 
+   && (strcmp(_nvsPendingActive->name_key, name_key) == 0)
+   && ((name_group) && (strcmp(_nvsPendingActive->name_group, name_group) == 0))) {
+    item = _nvsPendingActive;
+  };
+  bool queued = false;
+  if (item) {
+    if (type_value != OPT_TYPE_STRING) {
+      setNewValue(type_value, value, item->value);
+      queued = true;
+    } else if (str_ref) {
+      char* str_value = nvsValueStrdup((char*)item->value);
+      if (str_value) {
+        nvsValueFree(*str_ref);
+        *str_ref = str_value;
+        queued = true;
+      };
+    } else if (strlen((char*)item->value) <= strlen((char*)value)) {
+      // nvsRead() never reallocates the caller's string
+      strcpy((char*)value, (char*)item->value);
+      queued = true;
     };
   };
+  xSemaphoreGive(lock);
+
+  if (queued) {
+    rlog_d(logTAG, "NVS partition is not ready yet, used queued value for \"%s.%s\"", name_group, name_key);
+  } else {
+    rlog_w(logTAG, "NVS partition is not ready yet, used default value for \"%s.%s\"", name_group, name_key);
+  };
+  return true;
+}
+
+static void nvsInitTask(void* arg)
+{
+  _nvsInitTask = xTaskGetCurrentTaskHandle();
+  esp_err_t err = nvsFlashInit();
+
+  // Write the queued values before anyone else can write to the same keys. The lock is held only to take the next
+  // item, so early reads and new writes do not wait for flash; writers keep queueing until the queue is empty
+  SemaphoreHandle_t lock = nvsInitLock();
+  nvs_ready_head_t ready_list = STAILQ_HEAD_INITIALIZER(ready_list);
+  nvs_pending_item_t* item = nullptr;
+  uint32_t queued = 0;
+  do {
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (item) nvsPendingFree(item);
+    item = STAILQ_FIRST(&_nvsPendingList);
+    if (item) {
+      STAILQ_REMOVE_HEAD(&_nvsPendingList, next);
+    } else {
+      // The partition is reported as initialized only after the queue has been written. Writers that were waiting
+      // for the lock see the completed state and go directly to the partition, so nothing is queued after the drain
+      _nvsInit = (err == ESP_OK);
+      nvsInitFinish(&ready_list);
+    };
+    _nvsPendingActive = item;
+    xSemaphoreGive(lock);
+
+    if (item) {
+      if (err == ESP_OK) {
+        nvsWriteValue(item->name_group, item->name_key, item->type_value, item->value);
+      };
+      queued++;
+    };
+  } while (item);
+  if ((err != ESP_OK) && (queued > 0)) {
+    rlog_e(logTAG, "%" PRIu32 " queued values were lost", queued);
+  };
+  nvsInitComplete(err, &ready_list);
+
+  vTaskDelete(nullptr);
+}
+
+static bool nvsInitPending()
+{
+  return (_nvsInitEvents) && !(xEventGroupGetBits(_nvsInitEvents) & NVS_INIT_DONE_BIT);
+}
+
+// Direct access to the partition waits for the staged initialization, except for the init task itself
+static bool nvsAccessAllowed()
+{
+  if (!nvsInitPending() || (xTaskGetCurrentTaskHandle() == _nvsInitTask.load())) return true;
+  return nvsInitWait(CONFIG_NVS_EARLY_READ_TIMEOUT);
+}
+
+bool nvsInitStart(nvs_early_read_t early_read)
+{
+  if ((_nvsInit) || (_nvsInitEvents)) return true;
+
+  _nvsEarlyRead = early_read;
+  _nvsInitEvents = xEventGroupCreate();
+  if ((nvsInitLock()) && (_nvsInitEvents)
+   && (xTaskCreate(nvsInitTask, "nvs_init", CONFIG_NVS_INIT_TASK_STACK_SIZE, nullptr, CONFIG_NVS_INIT_TASK_PRIORITY, nullptr) == pdPASS)) {
+    rlog_i(logTAG, "NVS partition initialization started");
+    return true;
+  };
+
+  rlog_e(logTAG, "Failed to start NVS initialization task, initializing synchronously");
+  if (_nvsInitEvents) vEventGroupDelete(_nvsInitEvents);
+  _nvsInitEvents = nullptr;
+  return nvsInit();
+}
+
+bool nvsInitWait(uint32_t timeout_ms)
+{
+  if (nvsInitPending()) {
+    xEventGroupWaitBits(_nvsInitEvents, NVS_INIT_DONE_BIT, pdFALSE, pdTRUE, 
+      timeout_ms == UINT32_MAX ? portMAX_DELAY : pdMS_TO_TICKS(timeout_ms));
+  };
+  return nvsIsReady();
+}
+
+bool nvsIsReady()
+{
+  return (_nvsInit) && !nvsInitPending();
+}
+
+bool nvsOnReady(nvs_ready_cb_t cb, void* arg)
+{
+  if (!cb) return false;
+
+  SemaphoreHandle_t lock = nvsInitLock();
+  if (!lock) return false;
+  xSemaphoreTake(lock, portMAX_DELAY);
+  if (!_nvsInitDone) {
+    nvs_ready_item_t* item = (nvs_ready_item_t*)esp_malloc(sizeof(nvs_ready_item_t));
+    if (item) {
+      item->cb = cb;
+      item->arg = arg;
+      STAILQ_INSERT_TAIL(&_nvsReadyList, item, next);
+    };
+    xSemaphoreGive(lock);
+    RE_MEM_CHECK(item, return false);
+    return true;
+  };
+  xSemaphoreGive(lock);
+
+  // Initialization has already been completed
+  cb(_nvsInitInfo.result, arg);
+  return true;
+}
+
+void nvsGetInitInfo(nvs_init_info_t* info)
+{
+  if (info) {
+    *info = _nvsInitInfo;
+  };
+}
+
+bool nvsInit()
+{
+  if (nvsInitPending()) {
+    return nvsInitWait(UINT32_MAX);
+  };
+  if (!_nvsInit) {
+    esp_err_t err = nvsFlashInit();
+    nvs_ready_head_t ready_list = STAILQ_HEAD_INITIALIZER(ready_list);
+    SemaphoreHandle_t lock = nvsInitLock();
+    if (lock) xSemaphoreTake(lock, portMAX_DELAY);
+    _nvsInit = (err == ESP_OK);
+    nvsInitFinish(&ready_list);
+    if (lock) xSemaphoreGive(lock);
+    nvsInitComplete(err, &ready_list);
+  };
   return _nvsInit;
 }
 
 bool nvsOpen(const char* name_group, nvs_open_mode_t open_mode, nvs_handle_t *nvs_handle)
 {
-  esp_err_t err = nvs_open(name_group, open_mode, nvs_handle); 
+  if (!nvsAccessAllowed()) {
+    rlog_e(logTAG, "Error opening NVS namespace \"%s\": partition is not ready!", name_group);
+    return false;
+  };
+
+  NVS_TRACE_START(t_open);
+  esp_err_t err = nvs_open(name_group, open_mode, nvs_handle);
+  NVS_TRACE_STOP(t_open, NVS_TRACE_OPEN, name_group, nullptr, err);
   if (err != ESP_OK) {
     if (!((err == ESP_ERR_NVS_NOT_FOUND) && (open_mode == NVS_READONLY))) {
       rlog_e(logTAG, "Error opening NVS namespace \"%s\": %d (%s)!", name_group, err, esp_err_to_name(err));
@@ -491,18 +1145,27 @@ bool nvsOpen(const char* name_group, nvs_open_mode_t open_mode, nvs_handle_t *nv
   return true;
 }
 
-bool nvsRead(const char* name_group, const char* name_key, const param_type_t type_value, void * value)
+// str_ref: address of the caller's string pointer, which can be replaced by a larger buffer
+static bool nvsReadValue(const char* name_group, const char* name_key, const param_type_t type_value, void * value, char** str_ref)
 {
   // Check values
   if (!name_key) {
     rlog_e(logTAG, "Failed to read value: name_key is NULL!");
     return false;
   };
-  if (!value) {
+  if ((!value) && (!str_ref)) {
     rlog_e(logTAG, "Failed to read NULL value!");
     return false;
   };
 
+  // The partition is still being initialized: wait a bit if allowed, then use the queued or default value
+  if (nvsInitPending()) {
+    if (_nvsEarlyRead == NVS_EARLY_READ_WAIT) {
+      nvsInitWait(CONFIG_NVS_EARLY_READ_TIMEOUT);
+    };
+    if (nvsPendingRead(name_group, name_key, type_value, value, str_ref)) return true;
+  };
+
   nvs_handle_t nvs_handle;
   // Open NVS namespace
   if (!nvsOpen(name_group, NVS_READONLY, &nvs_handle)) return false;
@@ -512,45 +1175,57 @@ bool nvsRead(const char* name_group, const char* name_key, const param_type_t ty
   if (type_value == OPT_TYPE_STRING) {
     // Get the size of the string that is in the storage
     size_t new_len = 0;
+    NVS_TRACE_START(t_len);
     err = nvs_get_str(nvs_handle, name_key, nullptr, &new_len);
+    NVS_TRACE_STOP(t_len, NVS_TRACE_GET, name_group, name_key, err);
     if (err == ESP_ERR_NVS_NOT_FOUND) {
-      rlog_d(logTAG, "Value \"%s.%s\" is not initialized yet, used default: [%s]", name_group, name_key, (char*)value);
+      NVS_DIAG(RLOG_LEVEL_DEBUG, NVS_DIAG_READ_DEFAULT, name_group, name_key, type_value, value, err);
     }
     else {
       if (err != ESP_OK) {
-        rlog_w(logTAG, "Error reading string \"%s.%s\": %d (%s)!", name_group, name_key, err, esp_err_to_name(err));
+        NVS_DIAG(RLOG_LEVEL_WARN, NVS_DIAG_READ, name_group, name_key, type_value, nullptr, err);
       };
     }
 
     // If the result of reading the length is successful, read the line itself
     if (err == ESP_OK) {
-      size_t old_len = strlen((char*)value)+1;
-      char* prev_value = nullptr;
-      // Allocate a new block of memory if the size of the string is different
-      if (new_len != old_len) {
-        // Let's save the pointer to the previous data for now (in case of failure)
-        prev_value = (char*)value;
-        value = esp_malloc(new_len);
+      char* str_value = (char*)value;
+      size_t old_len = str_value ? strlen(str_value) + 1 : 0;
+      // The stored string does not fit into the current buffer
+      if (new_len > old_len) {
+        if (str_ref) {
+          str_value = (char*)nvsValueAlloc(new_len);
+          if (!str_value) err = ESP_ERR_NO_MEM;
+        } else {
+          // The caller's pointer cannot be replaced: the current value is kept, nvsReadString() should be used
+          NVS_DIAG(RLOG_LEVEL_WARN, NVS_DIAG_READ, name_group, name_key, type_value, nullptr, ESP_ERR_NVS_INVALID_LENGTH);
+          nvs_close(nvs_handle);
+          return true;
+        };
       };
       // Reading a line from storage
-      err = nvs_get_str(nvs_handle, name_key, (char*)value, &new_len);
       if (err == ESP_OK) {
-        // It's okay, delete the previous value
-        if (prev_value) {
-          free(prev_value);
+        NVS_TRACE_START(t_get);
+        err = nvs_get_str(nvs_handle, name_key, str_value, &new_len);
+        NVS_TRACE_STOP(t_get, NVS_TRACE_GET, name_group, name_key, err);
+      };
+      if (err == ESP_OK) {
+        // It's okay, replace the previous value
+        if (str_value != value) {
+          nvsValueFree(value);
+          *str_ref = str_value;
         };
-        rlog_d(logTAG, "Read string value \"%s.%s\": [%s]", name_group, name_key, (char*)value);
+        NVS_DIAG(RLOG_LEVEL_DEBUG, NVS_DIAG_READ, name_group, name_key, type_value, str_value, err);
       } else {
-        // We delete the allocated memory for new data and return the previous value
-        if (prev_value) {
-          free(value);
-          value = prev_value;
-          prev_value = nullptr;
+        // Delete the allocated memory, the caller keeps the previous value
+        if ((str_value) && (str_value != value)) {
+          nvsValueFree(str_value);
         };
-        rlog_e(logTAG, "Error reading string \"%s.%s\": %d (%s)!", name_group, name_key, err, esp_err_to_name(err));
+        NVS_DIAG(RLOG_LEVEL_ERROR, NVS_DIAG_READ, name_group, name_key, type_value, nullptr, err);
       };
     };
   } else {
+    NVS_TRACE_START(t_get);
     switch (type_value) {
       case OPT_TYPE_I8:
         err = nvs_get_i8(nvs_handle, name_key, (int8_t*)value);
@@ -592,31 +1267,39 @@ bool nvsRead(const char* name_group, const char* name_key, const param_type_t ty
         err = ESP_ERR_NVS_TYPE_MISMATCH;
         break;
     };
+    NVS_TRACE_STOP(t_get, NVS_TRACE_GET, name_group, name_key, err);
     
-    #if CONFIG_RLOG_PROJECT_LEVEL >= RLOG_LEVEL_ERROR
-      if (name_group && name_key) {
-        char* str_value = value2string(type_value, value);
-        RE_MEM_CHECK(str_value, return true);
-        switch (err) {
-          case ESP_OK:
-            rlog_d(logTAG, "Read value \"%s.%s\": [%s]", name_group, name_key, str_value);
-            break;
-          case ESP_ERR_NVS_NOT_FOUND:
-            rlog_d(logTAG, "Value \"%s.%s\" is not initialized yet, used default: [%s]", name_group, name_key, str_value);
-            break;
-          default :
-            rlog_e(logTAG, "Error reading \"%s.%s\": %d (%s)!", name_group, name_key, err, esp_err_to_name(err));
-            break;
-        };
-        free(str_value);
-      };
-    #endif // CONFIG_RLOG_PROJECT_LEVEL
+    switch (err) {
+      case ESP_OK:
+        NVS_DIAG(RLOG_LEVEL_DEBUG, NVS_DIAG_READ, name_group, name_key, type_value, value, err);
+        break;
+      case ESP_ERR_NVS_NOT_FOUND:
+        NVS_DIAG(RLOG_LEVEL_DEBUG, NVS_DIAG_READ_DEFAULT, name_group, name_key, type_value, value, err);
+        break;
+      default :
+        NVS_DIAG(RLOG_LEVEL_ERROR, NVS_DIAG_READ, name_group, name_key, type_value, nullptr, err);
+        break;
+    };
   };
 
   nvs_close(nvs_handle);
   return (err == ESP_OK || err == ESP_ERR_NVS_NOT_FOUND);
 }
 
+bool nvsRead(const char* name_group, const char* name_key, const param_type_t type_value, void * value)
+{
+  return nvsReadValue(name_group, name_key, type_value, value, nullptr);
+}
+
+bool nvsReadString(const char* name_group, const char* name_key, char** value)
+{
+  if (!value) {
+    rlog_e(logTAG, "Failed to read NULL value!");
+    return false;
+  };
+  return nvsReadValue(name_group, name_key, OPT_TYPE_STRING, *value, value);
+}
+
 bool nvsWrite(const char* name_group, const char* name_key, const param_type_t type_value, void * value)
 {
   // Check values
@@ -629,12 +1312,24 @@ bool nvsWrite(const char* name_group, const char* name_key, const param_type_t t
     return false;
   };
 
+  // The partition is still being initialized: the value will be written later
+  bool queued = false;
+  if ((name_group) && nvsPendingWrite(name_group, name_key, type_value, value, &queued)) {
+    return queued;
+  };
+
+  return nvsWriteValue(name_group, name_key, type_value, value);
+}
+
+static bool nvsWriteValue(const char* name_group, const char* name_key, const param_type_t type_value, void * value)
+{
   nvs_handle_t nvs_handle;
   // Open NVS namespace
   if (!nvsOpen(name_group, NVS_READWRITE, &nvs_handle)) return false;
 
   // Write value
   esp_err_t err = ESP_OK;
+  NVS_TRACE_START(t_set);
   switch (type_value) {
     case OPT_TYPE_I8:
       err = nvs_set_i8(nvs_handle, name_key, *(int8_t*)value);
@@ -679,24 +1374,301 @@ bool nvsWrite(const char* name_group, const char* name_key, const param_type_t t
       err = ESP_ERR_NVS_TYPE_MISMATCH;
       break;
   };
+  NVS_TRACE_STOP(t_set, NVS_TRACE_SET, name_group, name_key, err);
 
   if (err == ESP_OK) {
+    NVS_TRACE_START(t_commit);
     err = nvs_commit(nvs_handle);
+    NVS_TRACE_STOP(t_commit, NVS_TRACE_COMMIT, name_group, name_key, err);
   };
 
-  #if CONFIG_RLOG_PROJECT_LEVEL >= RLOG_LEVEL_ERROR
-    if (name_group && name_key) {
-      if (err == ESP_OK) {
-        rlog_i(logTAG, "Value \"%s.%s\" was successfully written to storage", name_group, name_key);
-      }
-      else {
-        rlog_e(logTAG, "Error writting \"%s.%s\": %d (%s)!", name_group, name_key, err, esp_err_to_name(err));
-      };
+  if (err == ESP_OK) {
+    NVS_DIAG(RLOG_LEVEL_INFO, NVS_DIAG_WRITE, name_group, name_key, type_value, value, err);
+  }
+  else {
+    NVS_DIAG(RLOG_LEVEL_ERROR, NVS_DIAG_WRITE, name_group, name_key, type_value, value, err);
+  };
+
+  nvs_close(nvs_handle);
+  return (err == ESP_OK);
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------- Record log ----------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+typedef struct {
+  uint32_t seq;
+  uint16_t record_size;
+  uint16_t count;
+} nvs_log_header_t;
+
+typedef struct nvs_log_t {
+  char* name_group;
+  uint16_t record_size;
+  uint16_t records_max;
+  uint16_t segments;
+  uint16_t count;
+  uint32_t seq;
+  bool dirty;
+  uint8_t* buffer;
+  SemaphoreHandle_t lock;
+} nvs_log_t;
+
+#define NVS_LOG_RECORDS(buf) ((buf) + sizeof(nvs_log_header_t))
+
+static size_t nvsLogSegmentSize(nvs_log_handle_t log)
+{
+  return sizeof(nvs_log_header_t) + (size_t)log->record_size * log->records_max;
+}
+
+static uint16_t nvsLogSlot(nvs_log_handle_t log, uint32_t seq)
+{
+  return (uint16_t)((seq - 1) % log->segments);
+}
+
+static void nvsLogKey(char* key, uint16_t slot)
+{
+  snprintf(key, NVS_KEY_NAME_MAX_SIZE, "seg%u", slot);
+}
+
+static esp_err_t nvsLogReadSegment(nvs_handle_t nvs_handle, nvs_log_handle_t log, uint16_t slot, uint8_t* buffer)
+{
+  char key[NVS_KEY_NAME_MAX_SIZE];
+  nvsLogKey(key, slot);
+  size_t size = nvsLogSegmentSize(log);
+  NVS_TRACE_START(t_get);
+  esp_err_t err = nvs_get_blob(nvs_handle, key, buffer, &size);
+  NVS_TRACE_STOP(t_get, NVS_TRACE_GET, log->name_group, key, err);
+  if (err == ESP_OK) {
+    nvs_log_header_t* hdr = (nvs_log_header_t*)buffer;
+    // A segment written with different log settings is treated as missing
+    if ((size < sizeof(nvs_log_header_t)) 
+     || (hdr->seq == 0)
+     || (hdr->record_size != log->record_size) 
+     || (hdr->count > log->records_max)
+     || (size != sizeof(nvs_log_header_t) + (size_t)hdr->count * log->record_size)) {
+      err = ESP_ERR_NVS_INVALID_LENGTH;
     };
-  #endif // CONFIG_RLOG_PROJECT_LEVEL
+  };
+  return err;
+}
 
+static bool nvsLogWriteSegment(nvs_log_handle_t log)
+{
+  nvs_handle_t nvs_handle;
+  if (!nvsOpen(log->name_group, NVS_READWRITE, &nvs_handle)) return false;
+
+  nvs_log_header_t* hdr = (nvs_log_header_t*)log->buffer;
+  hdr->seq = log->seq;
+  hdr->record_size = log->record_size;
+  hdr->count = log->count;
+
+  char key[NVS_KEY_NAME_MAX_SIZE];
+  nvsLogKey(key, nvsLogSlot(log, log->seq));
+  NVS_TRACE_START(t_set);
+  esp_err_t err = nvs_set_blob(nvs_handle, key, log->buffer, sizeof(nvs_log_header_t) + (size_t)log->count * log->record_size);
+  NVS_TRACE_STOP(t_set, NVS_TRACE_SET, log->name_group, key, err);
+  if (err == ESP_OK) {
+    NVS_TRACE_START(t_commit);
+    err = nvs_commit(nvs_handle);
+    NVS_TRACE_STOP(t_commit, NVS_TRACE_COMMIT, log->name_group, key, err);
+  };
   nvs_close(nvs_handle);
+
+  if (err == ESP_OK) {
+    log->dirty = false;
+    rlog_d(logTAG, "Log segment \"%s.%s\" #%" PRIu32 " written: %d records", log->name_group, key, log->seq, log->count);
+  } else {
+    rlog_e(logTAG, "Error writting log segment \"%s.%s\": %d (%s)!", log->name_group, key, err, esp_err_to_name(err));
+  };
   return (err == ESP_OK);
 }
 
+nvs_log_handle_t nvsLogOpen(const char* name_group, uint16_t record_size, uint16_t records_per_segment, uint16_t segments)
+{
+  if ((!name_group) || (record_size == 0) || (records_per_segment == 0) || (segments == 0)) {
+    rlog_e(logTAG, "Failed to open log: invalid arguments!");
+    return nullptr;
+  };
 
+  nvs_log_handle_t log = (nvs_log_handle_t)esp_malloc(sizeof(nvs_log_t));
+  RE_MEM_CHECK(log, return nullptr);
+  memset(log, 0, sizeof(nvs_log_t));
+  log->record_size = record_size;
+  log->records_max = records_per_segment;
+  log->segments = segments;
+  log->name_group = strdup(name_group);
+  log->buffer = (uint8_t*)esp_malloc(nvsLogSegmentSize(log));
+  log->lock = xSemaphoreCreateMutex();
+  if (!(log->name_group) || !(log->buffer) || !(log->lock)) {
+    rlog_e(logTAG, "Failed to open log \"%s\": out of memory!", name_group);
+    nvsLogClose(log);
+    return nullptr;
+  };
+
+  // Find the newest segment: the one with the largest sequence number.
+  // Only a missing namespace means an empty log, any other error would overwrite the history
+  if (!nvsAccessAllowed()) {
+    rlog_e(logTAG, "Failed to open log \"%s\": partition is not ready!", name_group);
+    nvsLogClose(log);
+    return nullptr;
+  };
+  nvs_handle_t nvs_handle;
+  NVS_TRACE_START(t_open);
+  esp_err_t err = nvs_open(name_group, NVS_READONLY, &nvs_handle);
+  NVS_TRACE_STOP(t_open, NVS_TRACE_OPEN, name_group, nullptr, err);
+  if (err == ESP_OK) {
+    uint16_t newest = 0;
+    for (uint16_t slot = 0; slot < segments; slot++) {
+      err = nvsLogReadSegment(nvs_handle, log, slot, log->buffer);
+      if (err == ESP_OK) {
+        nvs_log_header_t* hdr = (nvs_log_header_t*)log->buffer;
+        if ((hdr->seq > log->seq) && (nvsLogSlot(log, hdr->seq) == slot)) {
+          log->seq = hdr->seq;
+          newest = slot;
+        };
+      } else if ((err == ESP_ERR_NVS_NOT_FOUND) || (err == ESP_ERR_NVS_INVALID_LENGTH) || (err == ESP_ERR_NVS_TYPE_MISMATCH)) {
+        // Empty slot or a segment written with different settings
+        err = ESP_OK;
+      } else {
+        break;
+      };
+    };
+    // Reload the newest segment to continue appending to it
+    if ((err == ESP_OK) && (log->seq > 0)) {
+      err = nvsLogReadSegment(nvs_handle, log, newest, log->buffer);
+      if (err == ESP_OK) {
+        log->count = ((nvs_log_header_t*)log->buffer)->count;
+      };
+    };
+    nvs_close(nvs_handle);
+  } else if (err == ESP_ERR_NVS_NOT_FOUND) {
+    err = ESP_OK;
+  };
+  if (err != ESP_OK) {
+    rlog_e(logTAG, "Failed to open log \"%s\": %d (%s)!", name_group, err, esp_err_to_name(err));
+    nvsLogClose(log);
+    return nullptr;
+  };
+
+  if (log->seq == 0) {
+    log->seq = 1;
+    log->count = 0;
+  } else if (log->count >= log->records_max) {
+    log->seq++;
+    log->count = 0;
+  };
+
+  rlog_i(logTAG, "Log \"%s\" opened: segment #%" PRIu32 ", %d records", name_group, log->seq, log->count);
+  return log;
+}
+
+bool nvsLogAppend(nvs_log_handle_t log, const void* record)
+{
+  if ((!log) || (!record)) return false;
+
+  bool ret = true;
+  xSemaphoreTake(log->lock, portMAX_DELAY);
+  // The previous segment is full: make sure it is in storage and start the next one
+  if (log->count >= log->records_max) {
+    if ((log->dirty) && !nvsLogWriteSegment(log)) {
+      xSemaphoreGive(log->lock);
+      return false;
+    };
+    log->seq++;
+    log->count = 0;
+  };
+  memcpy(NVS_LOG_RECORDS(log->buffer) + (size_t)log->count * log->record_size, record, log->record_size);
+  log->count++;
+  log->dirty = true;
+  if (log->count >= log->records_max) {
+    ret = nvsLogWriteSegment(log);
+  };
+  xSemaphoreGive(log->lock);
+  return ret;
+}
+
+bool nvsLogFlush(nvs_log_handle_t log)
+{
+  if (!log) return false;
+
+  bool ret = true;
+  xSemaphoreTake(log->lock, portMAX_DELAY);
+  if ((log->dirty) && (log->count > 0)) {
+    ret = nvsLogWriteSegment(log);
+  };
+  xSemaphoreGive(log->lock);
+  return ret;
+}
+
+void nvsLogClose(nvs_log_handle_t log)
+{
+  if (log) {
+    if ((log->lock) && (log->buffer) && (log->name_group)) {
+      nvsLogFlush(log);
+    };
+    if (log->lock) vSemaphoreDelete(log->lock);
+    if (log->buffer) free(log->buffer);
+    if (log->name_group) free(log->name_group);
+    free(log);
+  };
+}
+
+bool nvsLogCursorInit(nvs_log_handle_t log, nvs_log_cursor_t* cursor)
+{
+  if ((!log) || (!cursor)) return false;
+
+  memset(cursor, 0, sizeof(nvs_log_cursor_t));
+  cursor->segment = (uint8_t*)esp_malloc(nvsLogSegmentSize(log));
+  RE_MEM_CHECK(cursor->segment, return false);
+  cursor->log = log;
+  xSemaphoreTake(log->lock, portMAX_DELAY);
+  cursor->seq_last = log->seq;
+  xSemaphoreGive(log->lock);
+  cursor->seq = cursor->seq_last >= log->segments ? cursor->seq_last - log->segments + 1 : 1;
+  return true;
+}
+
+bool nvsLogCursorNext(nvs_log_cursor_t* cursor, void* record)
+{
+  if ((!cursor) || (!cursor->log) || (!cursor->segment) || (!record)) return false;
+
+  nvs_log_handle_t log = cursor->log;
+  while (cursor->index >= cursor->count) {
+    if (cursor->seq > cursor->seq_last) return false;
+    
+    // Load the next segment: the current one is taken from RAM, the rest from storage
+    cursor->index = 0;
+    cursor->count = 0;
+    xSemaphoreTake(log->lock, portMAX_DELAY);
+    if (cursor->seq == log->seq) {
+      cursor->count = log->count;
+      memcpy(NVS_LOG_RECORDS(cursor->segment), NVS_LOG_RECORDS(log->buffer), (size_t)log->count * log->record_size);
+    } else if (cursor->seq + log->segments > log->seq) {
+      nvs_handle_t nvs_handle;
+      if (nvsOpen(log->name_group, NVS_READONLY, &nvs_handle)) {
+        if ((nvsLogReadSegment(nvs_handle, log, nvsLogSlot(log, cursor->seq), cursor->segment) == ESP_OK)
+         && (((nvs_log_header_t*)cursor->segment)->seq == cursor->seq)) {
+          cursor->count = ((nvs_log_header_t*)cursor->segment)->count;
+        };
+        nvs_close(nvs_handle);
+      };
+    };
+    xSemaphoreGive(log->lock);
+    cursor->seq++;
+  };
+
+  memcpy(record, NVS_LOG_RECORDS(cursor->segment) + (size_t)cursor->index * log->record_size, log->record_size);
+  cursor->index++;
+  return true;
+}
+
+void nvsLogCursorFree(nvs_log_cursor_t* cursor)
+{
+  if (cursor) {
+    if (cursor->segment) free(cursor->segment);
+    cursor->segment = nullptr;
+    cursor->log = nullptr;
+  };
+}
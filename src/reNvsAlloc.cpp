@@ -0,0 +1,212 @@
+#include <string.h>
+#include <stdlib.h>
+#include "reNvs.h"
+#include "rLog.h"
+#include "reEsp32.h"
+#include <freertos/FreeRTOS.h>
+#include "esp_heap_caps.h"
+#include "project_config.h"
+#if CONFIG_NVS_VALUE_PSRAM_THRESHOLD > 0
+#include "esp_idf_version.h"
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+#include "esp_memory_utils.h"
+#else
+#include "soc/soc_memory_layout.h"
+#endif // ESP_IDF_VERSION
+#endif // CONFIG_NVS_VALUE_PSRAM_THRESHOLD
+
+#if CONFIG_RLOG_PROJECT_LEVEL > RLOG_LEVEL_NONE
+static const char * logTAG = "NVS";
+#endif // CONFIG_RLOG_PROJECT_LEVEL
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ---------------------------------------------- Value memory allocation ------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+static portMUX_TYPE _nvsValueMux = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t _nvsValueHeap = 0;
+static uint32_t _nvsValuePsram = 0;
+
+#if CONFIG_NVS_VALUE_SLAB_ENABLE
+
+static_assert(CONFIG_NVS_VALUE_SLAB_BLOCKS % 32 == 0, "CONFIG_NVS_VALUE_SLAB_BLOCKS must be a multiple of 32");
+
+#define NVS_VALUE_SLAB_MAX  (1 << (NVS_VALUE_SLAB_CLASSES - 1))
+#define NVS_VALUE_SLAB_SIZE (((1 << NVS_VALUE_SLAB_CLASSES) - 1) * CONFIG_NVS_VALUE_SLAB_BLOCKS)
+
+typedef struct {
+  uint8_t* memory;
+  uint32_t used_map[CONFIG_NVS_VALUE_SLAB_BLOCKS / 32];
+  nvs_value_slab_stats_t stats;
+} nvs_value_slab_t;
+
+static uint8_t _nvsSlabArena[NVS_VALUE_SLAB_SIZE] __attribute__((aligned(8)));
+static nvs_value_slab_t _nvsSlabs[NVS_VALUE_SLAB_CLASSES];
+static bool _nvsSlabsInit = false;
+
+// Called inside the critical section
+static void nvsSlabInit()
+{
+  size_t offset = 0;
+  for (uint8_t i = 0; i < NVS_VALUE_SLAB_CLASSES; i++) {
+    _nvsSlabs[i].memory = _nvsSlabArena + offset;
+    _nvsSlabs[i].stats.block_size = 1 << i;
+    _nvsSlabs[i].stats.blocks = CONFIG_NVS_VALUE_SLAB_BLOCKS;
+    offset += (size_t)_nvsSlabs[i].stats.block_size * CONFIG_NVS_VALUE_SLAB_BLOCKS;
+  };
+  _nvsSlabsInit = true;
+}
+
+static void* nvsSlabAlloc(size_t size)
+{
+  uint8_t cls = 0;
+  while ((size_t)(1 << cls) < size) cls++;
+
+  void* ptr = nullptr;
+  portENTER_CRITICAL(&_nvsValueMux);
+  if (!_nvsSlabsInit) nvsSlabInit();
+  nvs_value_slab_t* slab = &_nvsSlabs[cls];
+  for (uint16_t w = 0; w < CONFIG_NVS_VALUE_SLAB_BLOCKS / 32; w++) {
+    if (slab->used_map[w] != UINT32_MAX) {
+      uint8_t bit = __builtin_ctz(~slab->used_map[w]);
+      slab->used_map[w] |= (1UL << bit);
+      ptr = slab->memory + (size_t)(w * 32 + bit) * slab->stats.block_size;
+      slab->stats.used++;
+      if (slab->stats.used > slab->stats.peak) slab->stats.peak = slab->stats.used;
+      break;
+    };
+  };
+  if (!ptr) slab->stats.overflows++;
+  portEXIT_CRITICAL(&_nvsValueMux);
+  return ptr;
+}
+
+static bool nvsSlabFree(void* ptr)
+{
+  uint8_t* p = (uint8_t*)ptr;
+  if ((p < _nvsSlabArena) || (p >= _nvsSlabArena + NVS_VALUE_SLAB_SIZE)) return false;
+
+  portENTER_CRITICAL(&_nvsValueMux);
+  for (uint8_t i = 0; i < NVS_VALUE_SLAB_CLASSES; i++) {
+    nvs_value_slab_t* slab = &_nvsSlabs[i];
+    size_t offset = p - slab->memory;
+    if (offset < (size_t)slab->stats.block_size * CONFIG_NVS_VALUE_SLAB_BLOCKS) {
+      size_t block = offset / slab->stats.block_size;
+      slab->used_map[block / 32] &= ~(1UL << (block % 32));
+      slab->stats.used--;
+      break;
+    };
+  };
+  portEXIT_CRITICAL(&_nvsValueMux);
+  return true;
+}
+
+#endif // CONFIG_NVS_VALUE_SLAB_ENABLE
+
+static void* nvsValueDefaultAlloc(size_t size, void* arg)
+{
+  void* ptr = nullptr;
+  #if CONFIG_NVS_VALUE_SLAB_ENABLE
+    if (size <= NVS_VALUE_SLAB_MAX) {
+      ptr = nvsSlabAlloc(size);
+      if (ptr) return ptr;
+    };
+  #endif // CONFIG_NVS_VALUE_SLAB_ENABLE
+  #if CONFIG_NVS_VALUE_PSRAM_THRESHOLD > 0
+    if (size >= CONFIG_NVS_VALUE_PSRAM_THRESHOLD) {
+      ptr = heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+      if (ptr) {
+        portENTER_CRITICAL(&_nvsValueMux);
+        _nvsValuePsram++;
+        portEXIT_CRITICAL(&_nvsValueMux);
+        return ptr;
+      };
+    };
+  #endif // CONFIG_NVS_VALUE_PSRAM_THRESHOLD
+  ptr = esp_malloc(size);
+  if (ptr) {
+    portENTER_CRITICAL(&_nvsValueMux);
+    _nvsValueHeap++;
+    portEXIT_CRITICAL(&_nvsValueMux);
+  };
+  return ptr;
+}
+
+static void nvsValueDefaultFree(void* ptr, void* arg)
+{
+  #if CONFIG_NVS_VALUE_SLAB_ENABLE
+    if (nvsSlabFree(ptr)) return;
+  #endif // CONFIG_NVS_VALUE_SLAB_ENABLE
+  bool psram = false;
+  #if CONFIG_NVS_VALUE_PSRAM_THRESHOLD > 0
+    psram = esp_ptr_external_ram(ptr);
+  #endif // CONFIG_NVS_VALUE_PSRAM_THRESHOLD
+  portENTER_CRITICAL(&_nvsValueMux);
+  if (psram) {
+    if (_nvsValuePsram > 0) _nvsValuePsram--;
+  } else {
+    if (_nvsValueHeap > 0) _nvsValueHeap--;
+  };
+  portEXIT_CRITICAL(&_nvsValueMux);
+  heap_caps_free(ptr);
+}
+
+static nvs_value_allocator_t _nvsValueAllocator = { nvsValueDefaultAlloc, nvsValueDefaultFree, nullptr };
+
+void nvsValueSetAllocator(const nvs_value_allocator_t* allocator)
+{
+  if ((allocator) && (allocator->alloc) && (allocator->free)) {
+    _nvsValueAllocator = *allocator;
+  } else {
+    _nvsValueAllocator = { nvsValueDefaultAlloc, nvsValueDefaultFree, nullptr };
+  };
+}
+
+void* nvsValueAlloc(size_t size)
+{
+  if (size == 0) return nullptr;
+  void* ptr = _nvsValueAllocator.alloc(size, _nvsValueAllocator.arg);
+  RE_MEM_CHECK(ptr, return nullptr);
+  return ptr;
+}
+
+char* nvsValueStrdup(const char* str)
+{
+  if (!str) return nullptr;
+  size_t size = strlen(str) + 1;
+  char* ret = (char*)nvsValueAlloc(size);
+  if (ret) {
+    memcpy(ret, str, size);
+  };
+  return ret;
+}
+
+void nvsValueFree(void* value)
+{
+  if (value) {
+    _nvsValueAllocator.free(value, _nvsValueAllocator.arg);
+  };
+}
+
+void nvsValueGetStats(nvs_value_alloc_stats_t* stats)
+{
+  if (!stats) return;
+
+  memset(stats, 0, sizeof(nvs_value_alloc_stats_t));
+  portENTER_CRITICAL(&_nvsValueMux);
+  #if CONFIG_NVS_VALUE_SLAB_ENABLE
+    if (!_nvsSlabsInit) nvsSlabInit();
+    for (uint8_t i = 0; i < NVS_VALUE_SLAB_CLASSES; i++) {
+      stats->slabs[i] = _nvsSlabs[i].stats;
+    };
+  #endif // CONFIG_NVS_VALUE_SLAB_ENABLE
+  stats->heap_allocs = _nvsValueHeap;
+  stats->psram_allocs = _nvsValuePsram;
+  portEXIT_CRITICAL(&_nvsValueMux);
+
+  stats->internal_free = heap_caps_get_free_size(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  stats->internal_largest = heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  if (stats->internal_free > 0) {
+    stats->fragmentation = (uint8_t)(100 - (uint64_t)stats->internal_largest * 100 / stats->internal_free);
+  };
+}